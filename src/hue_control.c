@@ -6,6 +6,7 @@
 *******************************************************************************/
 #include <string.h>
 #include "hue_control.h"
+#include "hue_keys.auto.h"
 #include "main.h"
 
 
@@ -21,24 +22,76 @@
 // but we want to future proof it, so we give it 128 chars + 1 terminator
 #define STORAGE_USER_LENGTH    129
 
+// Binary state frame, the hot path message in both directions. Layout:
+//   [0] version  [1] flags  [2] target light ID  [3] light state (light_t)
+//   [4] brightness 0-254  [5] sender session  [6-7] sequence, little endian
+#define STATE_FRAME_VERSION      1
+#define STATE_FRAME_LENGTH       8
+#define FRAME_FLAG_STATE      0x01
+#define FRAME_FLAG_BRIGHTNESS 0x02
+// The PebbleKit JS does not check the watch sequence, so it has no session
+#define STATE_FRAME_WATCH_SESSION 0
+// Scene names arrive in one string separated by new lines, the PebbleKit JS
+// already limits them to these sizes (name length in bytes, no terminator)
+#define SCENE_MAX_COUNT          8
+#define SCENE_NAME_LENGTH       20
+
 
 /*******************************************************************************
 * AppMessage Keys
 *******************************************************************************/
-enum {
-    KEY_LIGHT_STATE = 0,
-    KEY_BRIGHTNESS = 1,
-    KEY_BRIDGE_IP = 2,
-    KEY_BRIDGE_USER = 3,
-    KEY_LIGHT_ID = 4,
-    KEY_SETT_REQUEST = 5
-};
+// Expected tuple type for each key, integers can be sent with any width
+#define KEY_BRIDGE_IP_TYPE      TUPLE_CSTRING
+#define KEY_BRIDGE_USER_TYPE    TUPLE_CSTRING
+#define KEY_LIGHT_ID_TYPE       TUPLE_INT
+#define KEY_SETT_REQUEST_TYPE   TUPLE_INT
+#define KEY_STATE_FRAME_TYPE    TUPLE_BYTE_ARRAY
+#define KEY_SCENE_LIST_TYPE     TUPLE_CSTRING
+#define KEY_SCENE_RECALL_TYPE   TUPLE_INT
+
+/** Decoded state frame, the flags indicate which fields are in use. */
+typedef struct {
+    uint8_t flags;
+    int8_t target;
+    light_t state;
+    uint8_t brightness;
+    uint8_t session;
+    uint16_t sequence;
+} StateFrame;
+
+/**
+ * Values collected from a single walk of an inbox dictionary. The actions are
+ * taken once the whole dictionary has been read, as KEY_SETT_REQUEST changes
+ * what the light state and brightness in a state frame mean.
+ */
+typedef struct {
+    bool settings_request;
+    bool has_light_state;
+    bool has_brightness;
+    light_t light_state;
+    int16_t brightness;
+} InboxMessage;
+
+typedef void (*KeyHandler)(const Tuple *t, InboxMessage *message);
+
+typedef struct {
+    TupleType type;
+    KeyHandler handler;
+} KeyDecoder;
 
 
 /*******************************************************************************
 * Private function definitions
 *******************************************************************************/
 static char * translate_error(AppMessageResult result);
+static bool tuple_is_valid(const Tuple *t, TupleType type);
+static int32_t tuple_int(const Tuple *t);
+static void state_frame_encode(const StateFrame *frame, uint8_t *buffer);
+static bool state_frame_decode(
+        const uint8_t *buffer, uint16_t length, StateFrame *frame);
+static AppMessageResult send_state_frame(
+        uint8_t flags, light_t state, uint8_t brightness,
+        uint8_t retries, uint32_t retry_ms);
 static void store_bridge_ip(const char *cstring);
 static void store_bridge_username(const char *cstring);
 static void store_light_id(const int8_t light_id);
@@ -46,103 +99,294 @@ static char * get_stored_bridge_ip();
 static char * get_stored_bridge_username();
 static int8_t get_stored_light_id();
 
+#define KEY_HANDLER_PROTOTYPE(key, name) \
+    static void handle_##name(const Tuple *t, InboxMessage *message);
+HUE_MESSAGE_KEYS(KEY_HANDLER_PROTOTYPE)
+
+
+/*******************************************************************************
+* Local globals
+*******************************************************************************/
+// Dispatch table indexed by key offset from KEY_FIRST, every key in
+// package.json needs a handler
+#define KEY_DECODER_ENTRY(key, name) \
+    [key - KEY_FIRST] = { key##_TYPE, handle_##name },
+static const KeyDecoder key_decoders[KEY_COUNT] = {
+    HUE_MESSAGE_KEYS(KEY_DECODER_ENTRY)
+};
+
+// Last sent and received state frame sequence numbers, and received session
+static uint16_t tx_sequence = 0;
+static uint16_t rx_sequence = 0;
+static uint8_t rx_session = 0;
+static bool rx_sequence_valid = false;
+
+// Cached copy of the stored light ID, 0 if not yet read
+static int8_t light_id_cache = 0;
+
+// Scenes available for the light, as sent by the PebbleKit JS on launch
+static char scene_names[SCENE_MAX_COUNT][SCENE_NAME_LENGTH + 1];
+static uint8_t scene_count = 0;
+static int8_t scene_index = -1;
+
 
 /*******************************************************************************
 * AppMessage functions
 *******************************************************************************/
+/**
+ * Decodes the dictionary in a single pass through the key_decoders table,
+ * dropping unknown or badly typed tuples, and then acts on the result.
+ * KEY_SETT_REQUEST is a special case, it can be sent with an operation retry
+ * request (only light state and brightness designed), in which case the bridge
+ * settings are sent back and the operation is retried instead of shown.
+ */
 void inbox_received_callback(DictionaryIterator *iterator, void *context) {
-    int8_t level = 0;
-
-    // 1st we are going to check for the presence of KEY_SETT_REQUEST. This is
-    // a special case, this key can be sent with an operation retry request
-    // (only two options designed), and the program response is different:
-    Tuple *t = dict_read_first(iterator);
-    while (t != NULL) {
-        switch (t->key) {
-            case KEY_SETT_REQUEST:
-                // Retrieve bridge data from storage and send it back
-                send_bridge_settings();
-                //APP_LOG(APP_LOG_LEVEL_INFO, "Settings requested.");
-
-                // Start from the begging to look for the other key
-                t = dict_read_first(iterator);
-                while (t != NULL) {
-                    switch (t->key) {
-                        case KEY_LIGHT_STATE:
-                            // Try to toggle once again
-                            toggle_light_state();
-                            //APP_LOG(APP_LOG_LEVEL_INFO,
-                            //       "Toggle light with settings request.");
-                        break;
-                        case KEY_BRIGHTNESS:
-                            // Try to set brightness again with sent back data
-                            level =  (int8_t)(t->value->int16 / 2.56 );
-                            set_brightness(level);
-                            //APP_LOG(APP_LOG_LEVEL_INFO,
-                            //        "Set brightness with settings request: %d",
-                            //        t->value->int16);
-                        break;
-                        case KEY_SETT_REQUEST:  // Expected, already dealt with
-                            break;
-                        default:
-                            APP_LOG(APP_LOG_LEVEL_ERROR,
-                                    "Key %d supplied with KEY_SETT_REQUEST error!",
-                                    (int)t->key);
-                        break;
-                    }
-                    t = dict_read_next(iterator);
-                }
-                // Found and processed the KEY_SETT_REQUEST, can exit function
-                return;
-            default:  // If KEY_SETT_REQUEST not found, then just continue.
-                break;
+    InboxMessage message = { 0 };
+
+    for (Tuple *t = dict_read_first(iterator); t != NULL;
+            t = dict_read_next(iterator)) {
+        if ((t->key < KEY_FIRST) || (t->key - KEY_FIRST >= KEY_COUNT) ||
+                (key_decoders[t->key - KEY_FIRST].handler == NULL)) {
+            APP_LOG(APP_LOG_LEVEL_ERROR, "Key %d not recognized!",
+                    (int)t->key);
+            continue;
+        }
+        const KeyDecoder *decoder = &key_decoders[t->key - KEY_FIRST];
+        if (!tuple_is_valid(t, decoder->type)) {
+            APP_LOG(APP_LOG_LEVEL_ERROR, "Key %d with bad type %d!",
+                    (int)t->key, (int)t->type);
+            continue;
         }
-        if (t != NULL ) {
-            t = dict_read_next(iterator);
+        decoder->handler(t, &message);
+    }
+
+    if (message.settings_request) {
+        // Retrieve bridge data from storage and send it back
+        send_bridge_settings();
+        //APP_LOG(APP_LOG_LEVEL_INFO, "Settings requested.");
+        if (message.has_light_state) {
+            // Try to toggle once again
+            toggle_light_state();
         }
+        if (message.has_brightness) {
+            // Try to set brightness again with sent back data
+            set_brightness((int8_t)(message.brightness / 2.56));
+        }
+        return;
+    }
+    if (message.has_light_state) {
+        // Indicate to the GUI that the light is ON/OFF
+        gui_light_state(message.light_state);
+    }
+    if (message.has_brightness) {
+        // Indicate to the GUI the new light brightness value
+        gui_brightness_level((int8_t)(message.brightness / 2.56));
+    }
+}
+
+
+/**
+ * Checks the tuple type and length match what its key expects. Integer keys
+ * accept signed or unsigned values of 1, 2 or 4 bytes, as the PebbleKit JS
+ * picks the width itself.
+ */
+static bool tuple_is_valid(const Tuple *t, TupleType type) {
+    switch (type) {
+        case TUPLE_INT:
+        case TUPLE_UINT:
+            return ((t->type == TUPLE_INT) || (t->type == TUPLE_UINT)) &&
+                   ((t->length == 1) || (t->length == 2) || (t->length == 4));
+        case TUPLE_CSTRING:
+            return (t->type == TUPLE_CSTRING) && (t->length > 0) &&
+                   (t->value->cstring[t->length - 1] == '\0');
+        default:
+            return (t->type == type);
+    }
+}
+
+
+/** @return The integer value of a tuple validated by tuple_is_valid. */
+static int32_t tuple_int(const Tuple *t) {
+    bool is_signed = (t->type == TUPLE_INT);
+    switch (t->length) {
+        case 1:
+            return is_signed ? t->value->int8 : t->value->uint8;
+        case 2:
+            return is_signed ? t->value->int16 : t->value->uint16;
+        default:
+            return t->value->int32;
     }
+}
+
+
+/*******************************************************************************
+* AppMessage key handlers
+*******************************************************************************/
+static void handle_bridge_ip(const Tuple *t, InboxMessage *message) {
+    // Set the new IP address into storage
+    store_bridge_ip(t->value->cstring);
+}
+
+
+static void handle_bridge_user(const Tuple *t, InboxMessage *message) {
+    // Set the new bridge username into storage
+    store_bridge_username(t->value->cstring);
+}
+
+
+static void handle_light_id(const Tuple *t, InboxMessage *message) {
+    // Set the new light ID into storage
+    store_light_id((int8_t)tuple_int(t));
+}
+
+
+static void handle_sett_request(const Tuple *t, InboxMessage *message) {
+    message->settings_request = true;
+}
+
 
-    // Back to the first item and go through the keys as normal
-    t = dict_read_first(iterator);
-    while (t != NULL) {
-        switch (t->key) {
-            case KEY_LIGHT_STATE:
-                // Indicate to the GUI that the light is ON/OFF
-                gui_light_state((light_t)t->value->int8);
-                //APP_LOG(APP_LOG_LEVEL_INFO, "Light on is %d", t->value->int8);
-                break;
-            case KEY_BRIGHTNESS:
-                // Indicate to the GUI the new light brightness value
-                level =  (int8_t)(t->value->int16 / 2.56 );
-                gui_brightness_level(level);
-                //APP_LOG(APP_LOG_LEVEL_INFO, "Brightness is %d", level);
-                break;
-            case KEY_BRIDGE_IP:
-                // Set the new IP address into storage
-                store_bridge_ip(t->value->cstring);
-                //APP_LOG(APP_LOG_LEVEL_INFO, "Ip set to %s", t->value->cstring);
-                break;
-            case KEY_BRIDGE_USER:
-                // Set the new bridge username into storage
-                store_bridge_username(t->value->cstring);
-                //APP_LOG(APP_LOG_LEVEL_INFO, "User set to %s",
-                //        t->value->cstring);
-                break;
-            case KEY_LIGHT_ID:
-                // Set the new bridge username into storage
-                store_light_id(t->value->int8);
-                //APP_LOG(APP_LOG_LEVEL_INFO, "Light ID set to %d",
-                //        t->value->int8);
-                break;
-            case KEY_SETT_REQUEST:
-                // Already check for this key, so this should no happen
-            default:
-                APP_LOG(APP_LOG_LEVEL_ERROR, "Key %d not recognized!",
-                        (int)t->key);
+/**
+ * Splits the new line separated scene names into the scene table. Any names
+ * beyond SCENE_MAX_COUNT or SCENE_NAME_LENGTH are cut.
+ */
+static void handle_scene_list(const Tuple *t, InboxMessage *message) {
+    const char *name = t->value->cstring;
+    scene_count = 0;
+    scene_index = -1;
+    while ((*name != '\0') && (scene_count < SCENE_MAX_COUNT)) {
+        const char *end = strchr(name, '\n');
+        size_t length = (end == NULL) ? strlen(name) : (size_t)(end - name);
+        if (length > SCENE_NAME_LENGTH) {
+            length = SCENE_NAME_LENGTH;
+        }
+        memcpy(scene_names[scene_count], name, length);
+        scene_names[scene_count][length] = '\0';
+        scene_count++;
+        if (end == NULL) {
             break;
         }
-        t = dict_read_next(iterator);
+        name = end + 1;
     }
+    APP_LOG(APP_LOG_LEVEL_INFO, "Received %d scenes", scene_count);
+}
+
+
+/** Scene recalls are only sent from the watch, so this should not happen. */
+static void handle_scene_recall(const Tuple *t, InboxMessage *message) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Unexpected scene recall received!");
+}
+
+
+/**
+ * Unpacks a state frame into the message. The PebbleKit JS picks a new random
+ * session and starting sequence each time it starts, and resends the same
+ * frame when a delivery is not acknowledged, so only an exact repeat of the
+ * last (session, sequence) pair is a duplicate and is dropped.
+ * Frames targeting a different light than the stored one are dropped too, as
+ * they were sent before the settings changed.
+ */
+static void handle_state_frame(const Tuple *t, InboxMessage *message) {
+    StateFrame frame;
+    if (!state_frame_decode(t->value->data, t->length, &frame)) {
+        APP_LOG(APP_LOG_LEVEL_ERROR, "Invalid state frame, length %d",
+                (int)t->length);
+        return;
+    }
+    if (rx_sequence_valid && (frame.session == rx_session) &&
+            (frame.sequence == rx_sequence)) {
+        APP_LOG(APP_LOG_LEVEL_INFO, "Repeated state frame %u dropped",
+                frame.sequence);
+        return;
+    }
+    rx_sequence = frame.sequence;
+    rx_session = frame.session;
+    rx_sequence_valid = true;
+
+    int8_t light_id = get_stored_light_id();
+    if ((frame.target > 0) && (light_id > 0) && (frame.target != light_id)) {
+        APP_LOG(APP_LOG_LEVEL_INFO, "State frame for light %d dropped",
+                frame.target);
+        return;
+    }
+
+    if (frame.flags & FRAME_FLAG_STATE) {
+        message->has_light_state = true;
+        message->light_state = frame.state;
+    }
+    if (frame.flags & FRAME_FLAG_BRIGHTNESS) {
+        message->has_brightness = true;
+        message->brightness = frame.brightness;
+    }
+}
+
+
+/*******************************************************************************
+* State frame functions
+*******************************************************************************/
+static void state_frame_encode(const StateFrame *frame, uint8_t *buffer) {
+    buffer[0] = STATE_FRAME_VERSION;
+    buffer[1] = frame->flags;
+    buffer[2] = (uint8_t)frame->target;
+    buffer[3] = (uint8_t)(int8_t)frame->state;
+    buffer[4] = frame->brightness;
+    buffer[5] = frame->session;
+    buffer[6] = (uint8_t)(frame->sequence & 0xFF);
+    buffer[7] = (uint8_t)(frame->sequence >> 8);
+}
+
+
+/**
+ * Decodes a state frame from a byte array.
+ * @return True if the frame has the expected length and version.
+ */
+static bool state_frame_decode(
+        const uint8_t *buffer, uint16_t length, StateFrame *frame) {
+    if ((length != STATE_FRAME_LENGTH) ||
+            (buffer[0] != STATE_FRAME_VERSION)) {
+        return false;
+    }
+    frame->flags = buffer[1];
+    frame->target = (int8_t)buffer[2];
+    frame->state = (light_t)(int8_t)buffer[3];
+    frame->brightness = buffer[4];
+    frame->session = buffer[5];
+    frame->sequence = (uint16_t)(buffer[6] | (buffer[7] << 8));
+    return true;
+}
+
+
+/**
+ * Sends a state frame for the stored light to the PebbleKit JS app, retrying
+ * while the outbox is busy. Retries reuse the same sequence number.
+ * @return The result of the last send attempt.
+ */
+static AppMessageResult send_state_frame(
+        uint8_t flags, light_t state, uint8_t brightness,
+        uint8_t retries, uint32_t retry_ms) {
+    uint8_t buffer[STATE_FRAME_LENGTH];
+    StateFrame frame = {
+        .flags = flags,
+        .target = get_stored_light_id(),
+        .state = state,
+        .brightness = brightness,
+        .session = STATE_FRAME_WATCH_SESSION,
+        .sequence = ++tx_sequence
+    };
+    state_frame_encode(&frame, buffer);
+
+    DictionaryIterator *iterator;
+    app_message_outbox_begin(&iterator);
+    dict_write_data(iterator, KEY_STATE_FRAME, buffer, sizeof(buffer));
+    AppMessageResult result = app_message_outbox_send();
+    uint8_t counter = 0;
+    while ((counter < retries) && (result == APP_MSG_BUSY)) {
+        psleep(retry_ms);
+        app_message_outbox_begin(&iterator);
+        dict_write_data(iterator, KEY_STATE_FRAME, buffer, sizeof(buffer));
+        result = app_message_outbox_send();
+        counter++;
+    }
+    return result;
 }
 
 
@@ -246,6 +490,7 @@ static void store_bridge_username(const char *cstring) {
 
 
 static void store_light_id(const int8_t light_id) {
+    light_id_cache = light_id;
     status_t status = persist_write_int(KEY_LIGHT_ID, (const int32_t)light_id);
     // persist_write_int returns bytes written (4) on success, negative on error.
     if (status < S_SUCCESS) {
@@ -312,10 +557,15 @@ static char * get_stored_bridge_username() {
  * If the value has not yet been set, persist_read_int will return 0, in which
  * case we convert it to LIGHT_ID_ERROR. Thankfully! the HUE system starts
  * counting lights from value 1, so 0 should not be a use case.
+ * The value is cached after the first read, as it goes in every state frame.
  * @return The hue light bulb ID stored. 
  */
 static int8_t get_stored_light_id() {
+    if (light_id_cache != 0) {
+        return light_id_cache;
+    }
     int8_t light_id = (int8_t)persist_read_int(KEY_LIGHT_ID);
+    light_id_cache = light_id;
     if (0 == light_id) {
         APP_LOG(APP_LOG_LEVEL_INFO, "Light ID not found in Pebble");
         light_id = LIGHT_ID_ERROR;
@@ -336,26 +586,13 @@ static int8_t get_stored_light_id() {
  * APP_MSG_BUSY. So, it be retried up to 5 times.
  */
 void toggle_light_state() {
-    // Prepare dictionary, add key-value pair and send it
-    DictionaryIterator *iterator;
-    app_message_outbox_begin(&iterator);
-    // Value ignored, will always toggle
-    dict_write_int8(iterator, KEY_LIGHT_STATE, 0);
-    AppMessageResult result = app_message_outbox_send();
+    // State value ignored, will always toggle
+    AppMessageResult result = send_state_frame(
+            FRAME_FLAG_STATE, LIGHT_STATE_OFF, 0, 5, 75);
     if (result != APP_MSG_OK) {
-        uint8_t counter = 0;
-        while ((counter < 5) && (result == APP_MSG_BUSY)) {
-            psleep(75);
-            app_message_outbox_begin(&iterator);
-            dict_write_int8(iterator, KEY_LIGHT_STATE, 0);
-            result = app_message_outbox_send();
-            counter++;
-        }
-        if (result != APP_MSG_OK) {
-            APP_LOG(APP_LOG_LEVEL_ERROR, "Toggle light message error! %s",
-                    translate_error(result));
-        }
-    } 
+        APP_LOG(APP_LOG_LEVEL_ERROR, "Toggle light message error! %s",
+                translate_error(result));
+    }
 }
 
 
@@ -368,25 +605,44 @@ void toggle_light_state() {
  * @param level Brightness level from 0-99.
  */
 void set_brightness(int8_t level) {
-    // Prepare dictionary, add key-value pair and send it
+    AppMessageResult result = send_state_frame(
+            FRAME_FLAG_BRIGHTNESS, LIGHT_STATE_ON, (uint8_t)(level * 2.56),
+            3, 50);
+    if (result != APP_MSG_OK) {
+        APP_LOG(APP_LOG_LEVEL_ERROR, "Set brightness message error! %s",
+                translate_error(result));
+    }
+}
+
+
+/**
+ * Requests the PebbleKit JS app to recall the next scene in the list, which
+ * it does with a single group action request to the bridge.
+ * @return The name of the scene recalled, or NULL if there are no scenes.
+ */
+const char * recall_next_scene() {
+    if (scene_count == 0) {
+        return NULL;
+    }
+    scene_index = (scene_index + 1) % scene_count;
+
     DictionaryIterator *iterator;
     app_message_outbox_begin(&iterator);
-    dict_write_int16(iterator, KEY_BRIGHTNESS, (int16_t)(level * 2.56));
+    dict_write_int8(iterator, KEY_SCENE_RECALL, scene_index);
     AppMessageResult result = app_message_outbox_send();
+    uint8_t counter = 0;
+    while ((counter < 5) && (result == APP_MSG_BUSY)) {
+        psleep(75);
+        app_message_outbox_begin(&iterator);
+        dict_write_int8(iterator, KEY_SCENE_RECALL, scene_index);
+        result = app_message_outbox_send();
+        counter++;
+    }
     if (result != APP_MSG_OK) {
-        uint8_t counter = 0;
-        while ((counter < 3) && (result == APP_MSG_BUSY)) {
-            psleep(50);
-            app_message_outbox_begin(&iterator);
-            dict_write_int16(iterator, KEY_BRIGHTNESS, (int16_t)(level * 2.56));
-            result = app_message_outbox_send();
-            counter++;
-        }
-        if (result != APP_MSG_OK) {
-            APP_LOG(APP_LOG_LEVEL_ERROR, "Set brightness message error! %s",
-                    translate_error(result));
-        }
+        APP_LOG(APP_LOG_LEVEL_ERROR, "Recall scene message error! %s",
+                translate_error(result));
     }
+    return scene_names[scene_index];
 }
 
 
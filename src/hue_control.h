@@ -34,5 +34,6 @@ void outbox_failed_callback(
 void toggle_light_state();
 void set_brightness(int8_t level);
 void send_bridge_settings();
+const char * recall_next_scene();
 
 #endif  // HUE_CONTROL_H_
@@ -17,6 +17,41 @@ var OPTIONS = {
 // in the Pebble app. For dev it can be changed to a local  network URL.
 const CONFIG_URL = "https://carlosperate.github.io/PebbleQuickHue/config/index.html";
 
+// Local bridge discovery settings. The bridge answers in well under a second
+// on a LAN, so anything slower than PROBE_TIMEOUT_MS is treated as absent.
+// Addresses with nothing behind them take the full timeout, so a /24 sweep
+// needs ceil(254 / PROBE_CONCURRENCY) * PROBE_TIMEOUT_MS = 2.4 s, which fits
+// in DISCOVERY_TIMEOUT_MS, the cap for the whole discovery.
+const PROBE_TIMEOUT_MS = 600;
+const PROBE_CONCURRENCY = 64;
+const DISCOVERY_TIMEOUT_MS = 4000;
+// After a failed relocation, don't sweep again for this long (e.g. away from
+// home every launch would otherwise probe the LAN over cellular)
+const RELOCATE_RETRY_MS = 60 * 60 * 1000;
+// localStorage keys for the last bridge found, to notice DHCP IP changes, and
+// for the time of the last failed relocation
+const CACHE_BRIDGE_IP = "CACHE_BRIDGE_IP";
+const CACHE_BRIDGE_ID = "CACHE_BRIDGE_ID";
+const CACHE_RELOCATE_FAILED = "CACHE_RELOCATE_FAILED";
+
+// Binary state frame sent as KEY_STATE_FRAME, must match hue_control.c. Layout:
+//   [0] version  [1] flags  [2] target light ID  [3] light state
+//   [4] brightness 0-254  [5] sender session  [6-7] sequence, little endian
+const STATE_FRAME_VERSION = 1;
+const STATE_FRAME_LENGTH = 8;
+const FRAME_FLAG_STATE = 0x01;
+const FRAME_FLAG_BRIGHTNESS = 0x02;
+// Target sent by the watch when it has no light ID stored
+const FRAME_TARGET_UNKNOWN = -1;
+
+// Scenes for the light are cached in localStorage and only fetched again from
+// the bridge once the cache is older than SCENE_CACHE_MAX_AGE_MS. The count
+// and name length (in UTF-8 bytes) limits must match hue_control.c
+const SCENE_CACHE = "SCENE_CACHE";
+const SCENE_CACHE_MAX_AGE_MS = 24 * 60 * 60 * 1000;
+const SCENE_MAX_COUNT = 8;
+const SCENE_NAME_LENGTH = 20;
+
 
 /*******************************************************************************
 * PebbleKit JS functions
@@ -35,24 +70,33 @@ Pebble.addEventListener("showConfiguration", function(e) {
     // in-memory OPTIONS is empty and the form would open blank even though the
     // watch still has the settings persisted. Pull them back from the watch before
     // opening the URL so the form is pre-filled with the saved values.
-    loadSavedSettings(function() {
-        // Run N-UPnP discovery on every config open and pass the result as a separate
-        // param. The saved IP (if any) still populates the form; the detected IP is only
-        // applied when the user clicks the "Detect Bridge IP" button in the config page.
-        // Must be done here (phone-side JS) because the discovery endpoint's CORS policy
-        // blocks all browser origins.
-        discoverBridgeIp(function(detectedIp) {
-            const params = {
-                "HUE_BRIDGE_IP":   OPTIONS.HUE_BRIDGE_IP,
-                "HUE_BRIDGE_USER": OPTIONS.HUE_BRIDGE_USER,
-                "HUE_LIGHT_ID":    OPTIONS.HUE_LIGHT_ID,
-                "DETECTED_IP":     detectedIp || ""
-            };
-            const fullUrl = CONFIG_URL + "?" + encodeURIComponent(JSON.stringify(params));
-            console.log("Opening URL: " + fullUrl);
-            Pebble.openURL(fullUrl);
-        });
-    });
+    // Bridge discovery runs at the same time, so opening the page waits for
+    // whichever of the two takes longer (at most DISCOVERY_TIMEOUT_MS) and
+    // passes the result as a separate param. The saved IP (if any) still
+    // populates the form; the detected IP is only applied when the user clicks
+    // the "Detect Bridge IP" button in the config page.
+    // Must be done here (phone-side JS) because the discovery endpoint's CORS policy
+    // blocks all browser origins, and the config page cannot probe the LAN.
+    var detectedIp = null;
+    var pending = 2;
+    var openConfig = function() {
+        pending--;
+        if (pending > 0) return;
+        const params = {
+            "HUE_BRIDGE_IP":   OPTIONS.HUE_BRIDGE_IP,
+            "HUE_BRIDGE_USER": OPTIONS.HUE_BRIDGE_USER,
+            "HUE_LIGHT_ID":    OPTIONS.HUE_LIGHT_ID,
+            "DETECTED_IP":     detectedIp || ""
+        };
+        const fullUrl = CONFIG_URL + "?" + encodeURIComponent(JSON.stringify(params));
+        console.log("Opening URL: " + fullUrl);
+        Pebble.openURL(fullUrl);
+    };
+    loadSavedSettings(openConfig);
+    discoverBridgeIp(function(ip) {
+        detectedIp = ip;
+        openConfig();
+    }, false);
 });
 
 /**
@@ -79,27 +123,160 @@ function loadSavedSettings(callback) {
     // Reset so prior exhausted retries (from the ready-handler toggle) don't
     // block us from asking again here.
     requestBridgeAttemps = 0;
-    messageRequestBridgeData(null, null);
+    messageRequestBridgeData(null);
+}
+
+/**
+ * Locates the Hue Bridge on the local network and returns its IP.
+ * PebbleKit JS gives us no UDP sockets, so mDNS and SSDP are not available.
+ * Instead the /24 subnet of the last known IP is swept in parallel, starting
+ * with the known IP itself and working outwards from it, together with the
+ * cloud N-UPnP lookup as a fallback for networks we know nothing about.
+ * A bridge matching the cached bridge ID is always preferred, so a DHCP
+ * address change is picked up without needing internet access.
+ * The whole search gives up after DISCOVERY_TIMEOUT_MS.
+ * @param callback Called with the bridge IP and ID, or nulls if none found.
+ * @param localOnly Skip the cloud lookup, only the local network is searched.
+ */
+function discoverBridgeIp(callback, localOnly) {
+    var cache = loadBridgeCache();
+    var knownIp = cache.ip || OPTIONS.HUE_BRIDGE_IP;
+    var session = { "finished": false, "requests": [] };
+    var fallback = { "ip": null, "id": null };
+    var pending = (knownIp ? 1 : 0) + (localOnly ? 0 : 1);
+    var deadline = setTimeout(function() { done(fallback.ip, fallback.id); },
+                              DISCOVERY_TIMEOUT_MS);
+    var done = function(ip, bridgeId) {
+        if (session.finished) return;
+        session.finished = true;
+        clearTimeout(deadline);
+        for (var i = 0; i < session.requests.length; i++) {
+            session.requests[i].abort();
+        }
+        callback(ip, bridgeId);
+    };
+    var found = function(ip, bridgeId) {
+        if (session.finished) return;
+        if (!cache.id || isSameBridge(bridgeId, cache.id)) {
+            console.log("Discovered Hue Bridge " + bridgeId + " at " + ip);
+            saveBridgeCache(ip, bridgeId);
+            done(ip, bridgeId);
+        } else if (fallback.ip === null) {
+            fallback = { "ip": ip, "id": bridgeId };
+        }
+    };
+    var sourceDone = function() {
+        pending--;
+        if (pending === 0) done(fallback.ip, fallback.id);
+    };
+
+    if (pending === 0) {
+        done(null, null);
+        return;
+    }
+    if (knownIp) sweepSubnet(knownIp, session, found, sourceDone);
+    if (!localOnly) {
+        discoverBridgeIpCloud(session, function(ip, bridgeId) {
+            if (ip) found(ip, bridgeId);
+            sourceDone();
+        });
+    }
+}
+
+/**
+ * Probes the addresses in the /24 subnet of baseIp against /api/config,
+ * keeping at most PROBE_CONCURRENCY requests in flight. baseIp goes first,
+ * then its neighbours moving outwards, as DHCP usually hands out a nearby
+ * address. Calls found(ip, id) for each bridge that answers and complete()
+ * once every probe has finished.
+ */
+function sweepSubnet(baseIp, session, found, complete) {
+    var octets = baseIp.split(".");
+    var baseHost = parseInt(octets[3], 10);
+    if ((octets.length !== 4) || !(baseHost >= 1 && baseHost <= 254)) {
+        complete();
+        return;
+    }
+    var prefix = octets.slice(0, 3).join(".") + ".";
+    var candidates = [prefix + baseHost];
+    for (var step = 1; step < 254; step++) {
+        if ((baseHost + step) <= 254) candidates.push(prefix + (baseHost + step));
+        if ((baseHost - step) >= 1) candidates.push(prefix + (baseHost - step));
+    }
+    var next = 0;
+    var active = 0;
+    var launch = function() {
+        if (session.finished) return;
+        while ((active < PROBE_CONCURRENCY) && (next < candidates.length)) {
+            var ip = candidates[next++];
+            active++;
+            session.requests.push(probeBridge(ip, PROBE_TIMEOUT_MS, onProbe(ip)));
+        }
+        if ((active === 0) && (next >= candidates.length)) complete();
+    };
+    var onProbe = function(ip) {
+        return function(bridgeId) {
+            active--;
+            if (bridgeId) found(ip, bridgeId);
+            launch();
+        };
+    };
+    launch();
+}
+
+/**
+ * Checks if a Hue Bridge answers at the given IP. The /api/config endpoint
+ * does not require a username and includes the bridge unique ID.
+ * @return The XMLHttpRequest in flight, so the caller can abort it.
+ */
+function probeBridge(ip, timeout, callback) {
+    var xhr = new XMLHttpRequest();
+    var finished = false;
+    var done = function(bridgeId) {
+        if (finished) return;
+        finished = true;
+        callback(bridgeId);
+    };
+    xhr.open("GET", "http://" + ip + "/api/config", true);
+    xhr.timeout = timeout;
+    xhr.onload = function() {
+        if (xhr.status === 200) {
+            try {
+                var config = JSON.parse(xhr.responseText);
+                if (config && config.bridgeid) {
+                    done(config.bridgeid);
+                    return;
+                }
+            } catch (err) { /* Not a Hue Bridge */ }
+        }
+        done(null);
+    };
+    xhr.onerror = function() { done(null); };
+    xhr.ontimeout = function() { done(null); };
+    xhr.onabort = function() { done(null); };
+    xhr.send();
+    return xhr;
 }
 
 /** Queries Signify's discovery service and returns the first bridge's local IP. */
-function discoverBridgeIp(callback) {
+function discoverBridgeIpCloud(session, callback) {
     var xhr = new XMLHttpRequest();
+    session.requests.push(xhr);
     xhr.open("GET", "https://discovery.meethue.com/", true);
     xhr.timeout = 5000;
     var finished = false;
-    var done = function(ip) {
+    var done = function(ip, bridgeId) {
         if (finished) return;
         finished = true;
-        callback(ip);
+        callback(ip, bridgeId);
     };
     xhr.onload = function() {
         if (xhr.status === 200) {
             try {
                 var bridges = JSON.parse(xhr.responseText);
                 if (bridges && bridges.length > 0 && bridges[0].internalipaddress) {
-                    console.log("Discovered Hue Bridge at " + bridges[0].internalipaddress);
-                    done(bridges[0].internalipaddress);
+                    console.log("Cloud discovery found bridge at " + bridges[0].internalipaddress);
+                    done(bridges[0].internalipaddress, bridges[0].id);
                     return;
                 }
                 console.log("Discovery returned no bridges.");
@@ -109,23 +286,78 @@ function discoverBridgeIp(callback) {
         } else {
             console.log("Discovery HTTP " + xhr.status);
         }
-        done(null);
+        done(null, null);
     };
     xhr.onerror = function() {
         console.log("Discovery network error");
-        done(null);
+        done(null, null);
     };
     xhr.ontimeout = function() {
         console.log("Discovery timed out");
-        done(null);
+        done(null, null);
     };
+    xhr.onabort = function() { done(null, null); };
     xhr.send();
 }
 
+/**
+ * Called when the bridge stops answering at its configured IP. If the cached
+ * bridge can be found elsewhere on the local network the new IP is applied
+ * and sent to the watch for storage.
+ * The search never uses the cloud, and after a failed one it is not tried
+ * again for RELOCATE_RETRY_MS. The JS restarts on every app launch, so the
+ * time is kept in localStorage, otherwise away from home every launch would
+ * sweep the subnet over cellular.
+ * @param callback Called with true if the bridge was relocated.
+ */
+function relocateBridge(callback) {
+    var cache = loadBridgeCache();
+    var lastFailed = parseInt(localStorage.getItem(CACHE_RELOCATE_FAILED), 10);
+    if (!cache.id ||
+            (lastFailed && ((Date.now() - lastFailed) < RELOCATE_RETRY_MS))) {
+        callback(false);
+        return;
+    }
+    // Stored up front, so an app closed mid-search also counts as a failure
+    localStorage.setItem(CACHE_RELOCATE_FAILED, String(Date.now()));
+    discoverBridgeIp(function(ip, bridgeId) {
+        if (ip && isSameBridge(bridgeId, cache.id)) {
+            localStorage.removeItem(CACHE_RELOCATE_FAILED);
+        }
+        if (ip && (ip !== OPTIONS.HUE_BRIDGE_IP) &&
+                isSameBridge(bridgeId, cache.id)) {
+            console.log("Hue Bridge moved to " + ip);
+            OPTIONS.HUE_BRIDGE_IP = ip;
+            messageSetBridgeData(ip, null, null);
+            callback(true);
+        } else {
+            callback(false);
+        }
+    }, true);
+}
+
+/** Bridge IDs come in upper case from the bridge, lower case from the cloud. */
+function isSameBridge(idA, idB) {
+    return !!idA && !!idB && (idA.toLowerCase() === idB.toLowerCase());
+}
+
+function loadBridgeCache() {
+    return {
+        "ip": localStorage.getItem(CACHE_BRIDGE_IP) || "",
+        "id": localStorage.getItem(CACHE_BRIDGE_ID) || ""
+    };
+}
+
+function saveBridgeCache(ip, bridgeId) {
+    localStorage.setItem(CACHE_BRIDGE_IP, ip);
+    if (bridgeId) localStorage.setItem(CACHE_BRIDGE_ID, bridgeId);
+}
+
 Pebble.addEventListener("webviewclosed", function(e) {
     var setHueIp = null;
     var setHueUser = null;
     var setHueLightId = null;
+    var previousOwner = sceneOwner();
     var bridgeConfig = JSON.parse(decodeURIComponent(e.response));
     for (var i=0; i < bridgeConfig.length; i++) {
         if (bridgeConfig[i].name === "HUE_BRIDGE_IP") {
@@ -142,6 +374,19 @@ Pebble.addEventListener("webviewclosed", function(e) {
         }
     }
     messageSetBridgeData(setHueIp, setHueUser, setHueLightId);
+    // The scenes on the watch belong to the old user or light, replace them
+    if (sceneOwner() !== previousOwner) {
+        scenes = [];
+        scenesSent = false;
+        messageSendScenes(scenes, null);
+        if (areSettingSet()) loadScenes();
+    }
+    // Remember which bridge lives at this IP, so it can be found if it moves
+    if (setHueIp) {
+        probeBridge(setHueIp, PROBE_TIMEOUT_MS, function(bridgeId) {
+            if (bridgeId) saveBridgeCache(setHueIp, bridgeId);
+        });
+    }
 });
 
 
@@ -152,10 +397,22 @@ Pebble.addEventListener("webviewclosed", function(e) {
 Pebble.addEventListener("appmessage", function(e) {
     //console.log("AppMessage received! " + JSON.stringify(e.payload));
     for (var key in e.payload){
-        if (key == "KEY_LIGHT_STATE") {
-            toggleLightState();
-        } else if (key == "KEY_BRIGHTNESS") {
-            setLightBrightness(e.payload.KEY_BRIGHTNESS);
+        if (key == "KEY_STATE_FRAME") {
+            var frame = decodeStateFrame(e.payload.KEY_STATE_FRAME);
+            if (frame === null) {
+                console.log("Invalid state frame received in JS");
+            } else if (areSettingSet() &&
+                    (frame.target !== FRAME_TARGET_UNKNOWN) &&
+                    (frame.target !== OPTIONS.HUE_LIGHT_ID)) {
+                console.log("State frame for light " + frame.target +
+                            " dropped, light is " + OPTIONS.HUE_LIGHT_ID);
+            } else if (frame.flags & FRAME_FLAG_STATE) {
+                toggleLightState();
+            } else if (frame.flags & FRAME_FLAG_BRIGHTNESS) {
+                setLightBrightness(frame.brightness);
+            }
+        } else if (key == "KEY_SCENE_RECALL") {
+            recallScene(e.payload.KEY_SCENE_RECALL);
         } else if (key == "KEY_BRIDGE_IP") {
             OPTIONS.HUE_BRIDGE_IP = e.payload.KEY_BRIDGE_IP;
         } else if (key == "KEY_BRIDGE_USER") {
@@ -169,7 +426,6 @@ Pebble.addEventListener("appmessage", function(e) {
 });
 
 /** Sends and AppMessage with the ON/OFF state of the light. */
-var sendStateAttemps = 0; 
 function messageSendLightState(on_state) {
     // No boolean type defined, so need to send a 0/1 value
     var state = -1;
@@ -180,29 +436,32 @@ function messageSendLightState(on_state) {
     }
 
     // Assemble dictionary
-    var dictionary = { "KEY_LIGHT_STATE": state };
-    // Send the message, if an error occurs try again up to 3 times
-    Pebble.sendAppMessage(dictionary,
-            function(e) { sendStateAttemps = 0; },
-            function(e) {
-                reAttemp(e, sendStateAttemps, messageSendLightState);
-            });
+    var dictionary = {
+        "KEY_STATE_FRAME": encodeStateFrame(FRAME_FLAG_STATE, state, 0)
+    };
+    sendAppMessageWithRetry(dictionary, "Send light state", null);
 
     // Now that the ON/OFF data is on its way to the pebble, request the
     // current brightness as well so that it can be displayed too
     if (on_state === true) requestLightBrightness();
 }
 
-/** Sends and AppMessage with the ON/OFF state of the light. */
-var sendBrightnessAttemps = 0;
+/** Sends and AppMessage with the brightness level of the light. */
 function messageSendLightBrightness(level) {
-    var dictionary = { "KEY_BRIGHTNESS": level };
-    // Send the message, if an error occurs try again up to 3 times
-    Pebble.sendAppMessage(dictionary,
-            function(e) { sendBrightnessAttemps = 0; },
-            function(e) {
-                reAttemp(e, sendBrightnessAttemps, messageSendLightBrightness);
-            });
+    var dictionary = {
+        "KEY_STATE_FRAME": encodeStateFrame(FRAME_FLAG_BRIGHTNESS, 1, level)
+    };
+    sendAppMessageWithRetry(dictionary, "Send light brightness", null);
+}
+
+/**
+ * Sends the scene names, in index order, to the pebble as a single string.
+ * @param onSent Optional, called once the watch has acknowledged the list.
+ */
+function messageSendScenes(sceneList, onSent) {
+    var names = sceneList.map(function(scene) { return scene.name; });
+    var dictionary = { "KEY_SCENE_LIST": names.join("\n") };
+    sendAppMessageWithRetry(dictionary, "Send scenes", onSent);
 }
 
 /** Send the new Hue Bridge IP and Username to the pebble for app storage */
@@ -216,17 +475,23 @@ function messageSetBridgeData(ip, user, lightId) {
     if (lightId) dictionary["KEY_LIGHT_ID"]    = lightId;
     if (Object.keys(dictionary).length === 0) return;
 
-    // Retry up to 3 times on nack. Uses a local counter + closure so the
-    // original ip/user/lightId are resent on retry (the shared reAttemp
-    // helper calls its callback with no args, which would send undefined
-    // values and wipe the stored settings).
+    sendAppMessageWithRetry(dictionary, "Set bridge data", null);
+}
+
+/**
+ * Sends an AppMessage and, on a nack, resends the same dictionary up to 3
+ * times in total. Resending the original dictionary keeps the payload intact,
+ * and a state frame keeps its sequence so the watch can spot the duplicate.
+ * @param onSent Optional, called once the watch has acknowledged the message.
+ */
+function sendAppMessageWithRetry(dictionary, description, onSent) {
     var attempts = 0;
     var send = function() {
         Pebble.sendAppMessage(dictionary,
-            function(e) { /* delivered */ },
+            function(e) { if (onSent) onSent(); },
             function(e) {
                 attempts++;
-                console.log("Set bridge data failed (attempt " + attempts +
+                console.log(description + " failed (attempt " + attempts +
                             "): " + e.error.message);
                 if (attempts < 3) send();
             });
@@ -236,27 +501,59 @@ function messageSetBridgeData(ip, user, lightId) {
 
 /**
  * Request the Hue Bridge IP and Username from the pebble app storage.
- * If an additional request and value are provided it also sends those to be
- * resent back to the PebbleKit JS to re-try the operation.
+ * If a state frame is provided it also sends it to be resent back to the
+ * PebbleKit JS to re-try the operation.
  */
 var requestBridgeAttemps = 0;
-function messageRequestBridgeData(additionaRequest, additionalValue) {
+function messageRequestBridgeData(retryFrame) {
     // We only do 3 attemps triggered by function calls rather than nacks
     if (requestBridgeAttemps < 3) {
         var dictionary = { "KEY_SETT_REQUEST": 0 };  
-        if (additionaRequest !== null) {
-            dictionary[additionaRequest] = additionalValue;
+        if (retryFrame !== null) {
+            dictionary["KEY_STATE_FRAME"] = retryFrame;
         }
         Pebble.sendAppMessage(dictionary);
         requestBridgeAttemps++;
     }
 }
 
-function reAttemp(e, tracker, callback) {
-    console.log("Unable to deliver message Id=" + e.data.transactionId +
-                ", attempt " + tracker + ", Error is: " + e.error.message);
-    tracker++;
-    if (tracker < 3) callback();
+/**
+ * Packs a state frame into a byte array for the KEY_STATE_FRAME tuple. Each
+ * frame gets the next sequence number, so the watch can drop a resent copy.
+ * The random session (1-255) and random starting sequence tell the watch this
+ * JS instance restarted counting. Without a light ID the target is unknown.
+ */
+var stateFrameSession = 1 + Math.floor(Math.random() * 255);
+var stateFrameSequence = Math.floor(Math.random() * 0x10000);
+function encodeStateFrame(flags, state, brightness) {
+    stateFrameSequence = (stateFrameSequence + 1) & 0xFFFF;
+    var target = OPTIONS.HUE_LIGHT_ID ? OPTIONS.HUE_LIGHT_ID
+                                      : FRAME_TARGET_UNKNOWN;
+    return [STATE_FRAME_VERSION,
+            flags & 0xFF,
+            target & 0xFF,
+            state & 0xFF,
+            brightness & 0xFF,
+            stateFrameSession,
+            stateFrameSequence & 0xFF,
+            (stateFrameSequence >> 8) & 0xFF];
+}
+
+/** Unpacks a state frame byte array, returns null if it is not valid. */
+function decodeStateFrame(bytes) {
+    if (!bytes || (bytes.length !== STATE_FRAME_LENGTH) ||
+            (bytes[0] !== STATE_FRAME_VERSION)) {
+        return null;
+    }
+    // Light ID and state are signed bytes in the watch app
+    return {
+        "flags":      bytes[1],
+        "target":     (bytes[2] << 24) >> 24,
+        "state":      (bytes[3] << 24) >> 24,
+        "brightness": bytes[4],
+        "session":    bytes[5],
+        "sequence":   bytes[6] | (bytes[7] << 8)
+    };
 }
 
 
@@ -265,11 +562,19 @@ function reAttemp(e, tracker, callback) {
 *******************************************************************************/
 function toggleLightState() {
     if (!areSettingSet()) {
-        messageRequestBridgeData("KEY_LIGHT_STATE", 0);
+        messageRequestBridgeData(encodeStateFrame(FRAME_FLAG_STATE, 0, 0));
         return;
     }
-    const toggleCallback = function(jsonStrDataBack) {
-        if (!jsonStrDataBack) return;
+    const toggleCallback = function(jsonStrDataBack, status) {
+        if (!jsonStrDataBack) {
+            // No HTTP response at all, the bridge might have a new DHCP IP
+            if (status === 0) {
+                relocateBridge(function(moved) {
+                    if (moved) toggleLightState();
+                });
+            }
+            return;
+        }
         const parsedJson = JSON.parse(jsonStrDataBack);
         if (parsedJson.state && (parsedJson.state.on !== undefined)) {
             setLightState(!parsedJson.state.on);
@@ -296,6 +601,8 @@ function setLightState(on_state) {
         const lightKey = "/lights/" + OPTIONS.HUE_LIGHT_ID + "/state/on";
         if (parsedJson[0].success !== undefined) {
             messageSendLightState(parsedJson[0].success[lightKey]);
+            // Settings are known to be good now, make sure the watch has scenes
+            if (!scenesSent) loadScenes();
         } else {
             messageSendLightState(-1);
             console.log("Error in turn light callback: " + jsonStrDataBack);
@@ -309,7 +616,8 @@ function setLightState(on_state) {
 
 function setLightBrightness(level) {
     if (!areSettingSet()) {
-        messageRequestBridgeData("KEY_BRIGHTNESS", level);
+        messageRequestBridgeData(
+                encodeStateFrame(FRAME_FLAG_BRIGHTNESS, 1, level));
         return;
     }
     const setLightBrightnessCallback = function (jsonStrDataBack) {
@@ -340,6 +648,185 @@ function requestLightBrightness() {
     ajaxRequest(getLightUrl(), "GET", null, requestLightBrightnessCallback);
 }
 
+/**
+ * Sends the scene list to the watch, from the localStorage cache if it is for
+ * the same bridge user and light. The bridge is only asked for the scenes
+ * when there is no cache or it is older than SCENE_CACHE_MAX_AGE_MS, and the
+ * list is only resent to the watch if that check finds it has changed.
+ * scenesSent is only set once the watch acknowledges a list, so a failure
+ * here is retried on the next successful light toggle.
+ */
+var scenes = [];
+var scenesSent = false;
+function loadScenes() {
+    var owner = sceneOwner();
+    var onSent = function() { scenesSent = true; };
+    var cache = null;
+    try {
+        cache = JSON.parse(localStorage.getItem(SCENE_CACHE));
+    } catch (err) {
+        console.log("Scene cache parse error: " + err);
+    }
+    if (cache && (cache.owner === owner)) {
+        scenes = cache.scenes;
+        messageSendScenes(scenes, onSent);
+        if ((Date.now() - cache.checked) < SCENE_CACHE_MAX_AGE_MS) return;
+    } else {
+        cache = null;
+    }
+
+    const requestScenesCallback = function(jsonStrDataBack) {
+        if (!jsonStrDataBack) return;
+        var sceneList = null;
+        try {
+            sceneList = parseScenes(JSON.parse(jsonStrDataBack));
+        } catch (err) {
+            console.log("Error parsing scenes: " + err);
+            return;
+        }
+        var fingerprint = sceneList.map(function(scene) {
+            return scene.id + "@" + scene.updated;
+        }).join(",");
+        localStorage.setItem(SCENE_CACHE, JSON.stringify({
+            "owner": owner,
+            "checked": Date.now(),
+            "fingerprint": fingerprint,
+            "scenes": sceneList
+        }));
+        if (cache && (cache.fingerprint === fingerprint)) return;
+        scenes = sceneList;
+        messageSendScenes(scenes, onSent);
+    };
+    ajaxRequest("http://" + OPTIONS.HUE_BRIDGE_IP + "/api/" +
+                OPTIONS.HUE_BRIDGE_USER + "/scenes", "GET", null,
+                requestScenesCallback);
+}
+
+/**
+ * Picks the scenes that include our light out of the bridge scenes object,
+ * skipping the "recycle" scenes other apps create on the fly. The names are
+ * made safe for the watch: no new lines and at most SCENE_NAME_LENGTH bytes.
+ */
+function parseScenes(bridgeScenes) {
+    var sceneList = [];
+    var lightId = String(OPTIONS.HUE_LIGHT_ID);
+    for (var id in bridgeScenes) {
+        var scene = bridgeScenes[id];
+        if (scene.recycle || !scene.lights ||
+                (scene.lights.indexOf(lightId) === -1)) {
+            continue;
+        }
+        var name = trimUtf8((scene.name || id).replace(/\n/g, " "),
+                            SCENE_NAME_LENGTH);
+        sceneList.push({ "id": id, "name": name,
+                         "updated": scene.lastupdated || "" });
+    }
+    sceneList.sort(function(a, b) { return a.name < b.name ? -1 : 1; });
+    return sceneList.slice(0, SCENE_MAX_COUNT);
+}
+
+/** Scene caches and lists on the watch belong to a bridge user and light. */
+function sceneOwner() {
+    return OPTIONS.HUE_BRIDGE_USER + "/" + OPTIONS.HUE_LIGHT_ID;
+}
+
+/**
+ * Cuts a string to at most maxBytes once UTF-8 encoded, without splitting a
+ * character. Surrogate pairs (e.g. emoji) are kept or dropped as a whole.
+ */
+function trimUtf8(text, maxBytes) {
+    var bytes = 0;
+    for (var i = 0; i < text.length; i++) {
+        var code = text.charCodeAt(i);
+        var next = text.charCodeAt(i + 1);
+        var units = 1;
+        var size = 3;
+        if (code < 0x80) {
+            size = 1;
+        } else if (code < 0x800) {
+            size = 2;
+        } else if ((code >= 0xD800) && (code <= 0xDBFF) &&
+                   (next >= 0xDC00) && (next <= 0xDFFF)) {
+            size = 4;
+            units = 2;
+        }
+        if ((bytes + size) > maxBytes) return text.slice(0, i);
+        bytes += size;
+        i += units - 1;
+    }
+    return text;
+}
+
+/**
+ * Recalls a scene with a single group action request. The bridge applies it
+ * to all its lights, so our light state is read back and sent to the watch.
+ * The watch shows the scene name until a state frame arrives, so every
+ * failure still sends one back.
+ */
+function recallScene(index) {
+    if (!areSettingSet()) {
+        messageSendLightState(-1);
+        return;
+    }
+    if ((index < 0) || (index >= scenes.length)) {
+        // The watch list is out of date, send the light state and new scenes
+        console.log("Cannot recall scene " + index);
+        requestLightStateAndBrightness();
+        loadScenes();
+        return;
+    }
+    const recallSceneCallback = function(jsonStrDataBack) {
+        if (!jsonStrDataBack) {
+            messageSendLightState(-1);
+            return;
+        }
+        const parsedJson = JSON.parse(jsonStrDataBack);
+        if (parsedJson[0] && (parsedJson[0].success !== undefined)) {
+            requestLightStateAndBrightness();
+        } else {
+            // Likely a scene deleted since it was cached, so fetch the list
+            // again and show the real light state instead of an error
+            console.log("Error in recall scene callback: " + jsonStrDataBack);
+            localStorage.removeItem(SCENE_CACHE);
+            scenesSent = false;
+            loadScenes();
+            requestLightStateAndBrightness();
+        }
+    };
+    ajaxRequest("http://" + OPTIONS.HUE_BRIDGE_IP + "/api/" +
+                OPTIONS.HUE_BRIDGE_USER + "/groups/0/action", "PUT",
+                JSON.stringify({ "scene": scenes[index].id }),
+                recallSceneCallback);
+}
+
+/** Sends the light state, and brightness if it is ON, in one state frame. */
+function requestLightStateAndBrightness() {
+    const requestLightCallback = function(jsonStrDataBack) {
+        if (!jsonStrDataBack) {
+            messageSendLightState(-1);
+            return;
+        }
+        const parsedJson = JSON.parse(jsonStrDataBack);
+        if (!parsedJson.state || (parsedJson.state.on === undefined)) {
+            messageSendLightState(-1);
+            console.log("Error in getting light callback: " + jsonStrDataBack);
+            return;
+        }
+        // Lights without dimming have no brightness, only send the state
+        var frame;
+        if (parsedJson.state.on && (typeof parsedJson.state.bri === "number")) {
+            frame = encodeStateFrame(FRAME_FLAG_STATE | FRAME_FLAG_BRIGHTNESS,
+                                     1, parsedJson.state.bri);
+        } else {
+            frame = encodeStateFrame(FRAME_FLAG_STATE,
+                                     parsedJson.state.on ? 1 : 0, 0);
+        }
+        sendAppMessageWithRetry({ "KEY_STATE_FRAME": frame },
+                                "Send light state and brightness", null);
+    };
+    ajaxRequest(getLightUrl(), "GET", null, requestLightCallback);
+}
+
 function getLightUrl() {
     return "http://" + OPTIONS.HUE_BRIDGE_IP + "/api/" +
            OPTIONS.HUE_BRIDGE_USER + "/lights/" + OPTIONS.HUE_LIGHT_ID;
@@ -363,8 +850,9 @@ function ajaxRequest(url, type, data, callback) {
                 //logReturnedData(this.responseText);
                 callback(this.responseText);
             } else {
-                // return a null element, will be dealt with in callback
-                callback(null);
+                // return a null element, will be dealt with in callback,
+                // status 0 means the bridge could not be reached at all
+                callback(null, xhRequest.status);
             }
         }
     };
@@ -17,6 +17,11 @@
 #define LIGHT_OFF         -1
 #define MIN_BRIGHTNESS     1
 #define MAX_BRIGHTNESS    99
+// Brightness layer, value text above a horizontal gauge
+#define BRIGHTNESS_WIDTH  20
+#define BRIGHTNESS_TEXT_H 22
+#define BRIGHTNESS_GAUGE_H 5
+#define BRIGHTNESS_HEIGHT (BRIGHTNESS_TEXT_H + BRIGHTNESS_GAUGE_H + 1)
 
 
 /*******************************************************************************
@@ -25,13 +30,17 @@
 static Window *window;
 static ActionBarLayer *side_bar;
 static TextLayer *title_text_layer;
-static TextLayer *brightness_text_layer;
+static Layer *brightness_layer;
+static GFont brightness_font;
 static BitmapLayer *lightbulb_bitmap_layer;
-static GBitmap *lightbulb_bitmap;
+static GBitmap *lightbulb_on_bitmap;
+static GBitmap *lightbulb_off_bitmap;
 static GBitmap *icon_plus;
 static GBitmap *icon_minus;
 
 static int8_t brightness_level = LIGHT_OFF;
+// Value last drawn by brightness_layer, used to skip redundant redraws
+static int8_t brightness_drawn = LIGHT_OFF;
 
 
 /*******************************************************************************
@@ -42,10 +51,14 @@ static void window_load(Window *window);
 static void window_unload(Window *window);
 static void deinit(void);
 static void select_click_handler(ClickRecognizerRef recognizer, void *context);
+static void select_long_click_handler(
+        ClickRecognizerRef recognizer, void *context);
 static void up_click_handler(ClickRecognizerRef recognizer, void *context);
 static void down_click_handler(ClickRecognizerRef recognizer, void *context);
 static void click_config_provider(void *context);
 static void gui_update_brightness();
+static void gui_set_lightbulb(bool on);
+static void brightness_layer_update_proc(Layer *layer, GContext *ctx);
 
 
 /*******************************************************************************
@@ -106,24 +119,26 @@ static void window_load(Window *window) {
     text_layer_set_text_alignment(title_text_layer, GTextAlignmentCenter);
     layer_add_child(window_layer, text_layer_get_layer(title_text_layer));
 
-    // Set up the brightness text layer
-    brightness_text_layer = text_layer_create((GRect) {
+    // Set up the brightness layer, drawn by its own update proc so that a
+    // brightness step avoids snprintf and the TextLayer, and is only marked
+    // dirty when the value changes (any redraw renders the whole window)
+    brightness_font = fonts_get_system_font(FONT_KEY_GOTHIC_18_BOLD);
+    brightness_layer = layer_create((GRect) {
         .origin = { width, ((bounds.size.h/2) - 12)  },
-        .size = { 20, 24 }
+        .size = { BRIGHTNESS_WIDTH, BRIGHTNESS_HEIGHT }
     });
-    text_layer_set_font(
-        brightness_text_layer, fonts_get_system_font(FONT_KEY_GOTHIC_18_BOLD));
-    text_layer_set_text(brightness_text_layer, "NA");
-    text_layer_set_text_alignment(brightness_text_layer, GTextAlignmentCenter);
-    layer_add_child(window_layer, text_layer_get_layer(brightness_text_layer));
+    layer_set_update_proc(brightness_layer, brightness_layer_update_proc);
+    layer_add_child(window_layer, brightness_layer);
 
-    // Set up the image layer
-    lightbulb_bitmap = gbitmap_create_with_resource(RESOURCE_ID_LIGHTBULB);
+    // Set up the image layer, both bulb images are loaded once and swapped
+    lightbulb_on_bitmap = gbitmap_create_with_resource(RESOURCE_ID_LIGHTBULB);
+    lightbulb_off_bitmap =
+            gbitmap_create_with_resource(RESOURCE_ID_LIGHTBULB_OFF);
     lightbulb_bitmap_layer = bitmap_layer_create((GRect) {
         .origin = { ((width - 68) / 2), 30 },
         .size = { 68, 120 }
     });
-    bitmap_layer_set_bitmap(lightbulb_bitmap_layer, lightbulb_bitmap);
+    bitmap_layer_set_bitmap(lightbulb_bitmap_layer, lightbulb_on_bitmap);
     layer_add_child(
             window_layer, bitmap_layer_get_layer(lightbulb_bitmap_layer));
 }
@@ -131,8 +146,9 @@ static void window_load(Window *window) {
 
 static void window_unload(Window *window) {
     text_layer_destroy(title_text_layer);
-    text_layer_destroy(brightness_text_layer);
-    gbitmap_destroy(lightbulb_bitmap);
+    layer_destroy(brightness_layer);
+    gbitmap_destroy(lightbulb_on_bitmap);
+    gbitmap_destroy(lightbulb_off_bitmap);
     bitmap_layer_destroy(lightbulb_bitmap_layer);
     gbitmap_destroy(icon_plus);
     gbitmap_destroy(icon_minus);
@@ -157,6 +173,21 @@ static void select_click_handler(ClickRecognizerRef recognizer, void *context) {
 }
 
 
+/**
+ * Long pressing the select button recalls the next scene of the light. The
+ * scene name is shown until the new light state arrives from the bridge.
+ */
+static void select_long_click_handler(
+        ClickRecognizerRef recognizer, void *context) {
+    const char *scene_name = recall_next_scene();
+    if (scene_name == NULL) {
+        text_layer_set_text(title_text_layer, "No Scenes");
+    } else {
+        text_layer_set_text(title_text_layer, scene_name);
+    }
+}
+
+
 /**
  * Up button increments the brightness level in the GUI and request the same 
  * level to the hue bridge.
@@ -193,6 +224,8 @@ static void down_click_handler(ClickRecognizerRef recognizer, void *context) {
 
 static void click_config_provider(void *context) {
     window_single_click_subscribe(BUTTON_ID_SELECT, select_click_handler);
+    window_long_click_subscribe(
+            BUTTON_ID_SELECT, 500, select_long_click_handler, NULL);
     // Set up the repeating click for UP and DOWN with 200 ms interval
     window_single_repeating_click_subscribe(
             BUTTON_ID_UP, 100, up_click_handler);
@@ -210,19 +243,20 @@ void gui_light_state(light_t on_state) {
             text_layer_set_text(title_text_layer, "Light ON");
             // Brightness back to editable, upcoming AppMessage will set value
             brightness_level = 0;
-            // Future update the image will change to show a bright light bulb
+            gui_set_lightbulb(true);
             break;
         case LIGHT_STATE_OFF:
             text_layer_set_text(title_text_layer, "Light OFF");
             // Set the brightness level uneditable
             brightness_level = LIGHT_OFF;
             gui_update_brightness();
-            // Future update the image will change to show a dim light bulb 
+            gui_set_lightbulb(false);
             break;
         case LIGHT_STATE_POWER_OFF:
             // Inform the user the light switch is OFF
             text_layer_set_text(title_text_layer, "Power OFF");
             brightness_level = LIGHT_OFF;
+            gui_set_lightbulb(false);
             break;
         case LIGHT_STATE_ERROR:
             // No bridge contact, most likely incorrect settings
@@ -247,15 +281,62 @@ void gui_brightness_level(int8_t level) {
 }
 
 
+/**
+ * Requests a brightness layer redraw, but only if the value has changed. While
+ * a button is held at the top or bottom of the range this skips the redraw.
+ */
 static void gui_update_brightness() {
-    // Set a static buffer for this permanent text
-    static char brightness_text[3];
-    if (brightness_level == LIGHT_OFF) {
-        text_layer_set_text(brightness_text_layer, "NA");
-    } else {
-        snprintf(brightness_text, sizeof(brightness_text), "%u",
-                 brightness_level);
-        text_layer_set_text(brightness_text_layer, brightness_text);
+    if (brightness_level != brightness_drawn) {
+        brightness_drawn = brightness_level;
+        layer_mark_dirty(brightness_layer);
+    }
+}
+
+
+/** Swaps between the preloaded bright and dim light bulb images. */
+static void gui_set_lightbulb(bool on) {
+    GBitmap *bitmap = on ? lightbulb_on_bitmap : lightbulb_off_bitmap;
+    if (bitmap_layer_get_bitmap(lightbulb_bitmap_layer) != bitmap) {
+        bitmap_layer_set_bitmap(lightbulb_bitmap_layer, bitmap);
+    }
+}
+
+
+/**
+ * Draws the brightness value and a gauge bar below it. The digits are built
+ * by hand to avoid going through snprintf on every brightness step.
+ */
+static void brightness_layer_update_proc(Layer *layer, GContext *ctx) {
+    GRect bounds = layer_get_bounds(layer);
+    char brightness_text[3] = "NA";
+
+    graphics_context_set_fill_color(ctx, GColorWhite);
+    graphics_fill_rect(ctx, bounds, 0, GCornerNone);
+
+    if (brightness_drawn != LIGHT_OFF) {
+        if (brightness_drawn < 10) {
+            brightness_text[0] = '0' + brightness_drawn;
+            brightness_text[1] = '\0';
+        } else {
+            brightness_text[0] = '0' + (brightness_drawn / 10);
+            brightness_text[1] = '0' + (brightness_drawn % 10);
+        }
+    }
+    graphics_context_set_text_color(ctx, GColorBlack);
+    graphics_draw_text(ctx, brightness_text, brightness_font,
+                       GRect(0, -3, bounds.size.w, BRIGHTNESS_TEXT_H + 3),
+                       GTextOverflowModeFill, GTextAlignmentCenter, NULL);
+
+    // Gauge outline always drawn, filled proportionally to the brightness
+    GRect gauge = GRect(1, BRIGHTNESS_TEXT_H, bounds.size.w - 2,
+                        BRIGHTNESS_GAUGE_H);
+    graphics_context_set_stroke_color(ctx, GColorBlack);
+    graphics_draw_rect(ctx, gauge);
+    if (brightness_drawn != LIGHT_OFF) {
+        graphics_context_set_fill_color(ctx, GColorBlack);
+        graphics_fill_rect(ctx, GRect(gauge.origin.x, gauge.origin.y,
+                        (gauge.size.w * brightness_drawn) / MAX_BRIGHTNESS,
+                        gauge.size.h), 0, GCornerNone);
     }
 }
 
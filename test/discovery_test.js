@@ -0,0 +1,178 @@
+/*******************************************************************************
+* Bridge discovery checks for the PebbleKit JS code, run with:
+*     node test/discovery_test.js
+*
+* Copyright (c) 2015 carlosperate https://github.com/carlosperate/
+* Licensed under The MIT License (MIT), a copy can be found in the LICENSE file.
+*
+* Loads src/hue_link.js with stand-ins for the PebbleKit JS globals. The
+* XMLHttpRequest stand-in simulates a LAN: listed addresses answer /api/config
+* as a Hue Bridge, and every other address never answers, so its probe waits
+* for the full timeout like a real unused address would.
+*******************************************************************************/
+var fs = require("fs");
+var path = require("path");
+var vm = require("vm");
+
+var SOURCE = fs.readFileSync(
+        path.join(__dirname, "..", "src", "hue_link.js"), "utf8");
+var OUR_BRIDGE = "001788FFFEAAAAAA";
+var OTHER_BRIDGE = "001788FFFEBBBBBB";
+
+/** Creates a fresh JS runtime, as on every app launch, with shared storage. */
+function loadHueLink(network, storage) {
+    var probes = [];
+    var sent = [];
+    function FakeXHR() {}
+    FakeXHR.prototype.open = function(method, url) { this.url = url; };
+    FakeXHR.prototype.send = function() {
+        var xhr = this;
+        var host = xhr.url.split("/")[2];
+        probes.push(host);
+        if (xhr.url.indexOf("https://discovery.meethue.com") === 0) {
+            // No internet access, the cloud lookup never answers either
+            xhr.timer = setTimeout(function() {
+                if (xhr.ontimeout) xhr.ontimeout();
+            }, xhr.timeout || 5000);
+            return;
+        }
+        var bridgeId = network[host];
+        if (bridgeId) {
+            xhr.timer = setTimeout(function() {
+                xhr.status = 200;
+                xhr.readyState = 4;
+                xhr.responseText = JSON.stringify({ "bridgeid": bridgeId });
+                if (xhr.onload) xhr.onload();
+            }, 20);
+        } else if (xhr.timeout) {
+            xhr.timer = setTimeout(function() {
+                if (xhr.ontimeout) xhr.ontimeout();
+            }, xhr.timeout);
+        }
+    };
+    FakeXHR.prototype.abort = function() {
+        clearTimeout(this.timer);
+        if (this.onabort) this.onabort();
+    };
+
+    var context = {
+        "console": { "log": function() {} },
+        "setTimeout": setTimeout,
+        "clearTimeout": clearTimeout,
+        "setInterval": setInterval,
+        "clearInterval": clearInterval,
+        "XMLHttpRequest": FakeXHR,
+        "localStorage": {
+            "getItem": function(key) {
+                return storage.hasOwnProperty(key) ? storage[key] : null;
+            },
+            "setItem": function(key, value) { storage[key] = String(value); },
+            "removeItem": function(key) { delete storage[key]; }
+        },
+        "Pebble": {
+            "addEventListener": function() {},
+            "sendAppMessage": function(dictionary) { sent.push(dictionary); }
+        }
+    };
+    vm.createContext(context);
+    vm.runInContext(SOURCE, context);
+    context.probes = probes;
+    context.sent = sent;
+    return context;
+}
+
+function cachedStorage(ip) {
+    var storage = {};
+    storage.CACHE_BRIDGE_IP = ip;
+    storage.CACHE_BRIDGE_ID = OUR_BRIDGE;
+    return storage;
+}
+
+var failures = 0;
+function check(name, condition, detail) {
+    console.log((condition ? "PASS " : "FAIL ") + name + " (" + detail + ")");
+    if (!condition) failures++;
+}
+
+/** Runs relocateBridge() in a fresh runtime whose settings use oldIp. */
+function relocate(network, storage, oldIp, callback) {
+    var hueLink = loadHueLink(network, storage);
+    hueLink.OPTIONS.HUE_BRIDGE_IP = oldIp;
+    var start = Date.now();
+    hueLink.relocateBridge(function(moved) {
+        callback(moved, Date.now() - start, hueLink);
+    });
+}
+
+var tests = [
+    function knownIpStillAnswers(next) {
+        var hueLink = loadHueLink({ "192.168.1.10": OUR_BRIDGE },
+                                  cachedStorage("192.168.1.10"));
+        var start = Date.now();
+        hueLink.discoverBridgeIp(function(ip) {
+            var elapsed = Date.now() - start;
+            check("known IP answers", (ip === "192.168.1.10") && (elapsed < 200),
+                  ip + " in " + elapsed + " ms");
+            next();
+        }, false);
+    },
+    function bridgeMovedIntoDhcpPool(next) {
+        var storage = cachedStorage("192.168.1.10");
+        relocate({ "192.168.1.200": OUR_BRIDGE }, storage, "192.168.1.10",
+                 function(moved, elapsed, hueLink) {
+            check("moved into .100-.254 pool",
+                  moved && (hueLink.OPTIONS.HUE_BRIDGE_IP === "192.168.1.200"),
+                  hueLink.OPTIONS.HUE_BRIDGE_IP + " in " + elapsed + " ms");
+            check("new IP sent to watch",
+                  hueLink.sent.length === 1 &&
+                  hueLink.sent[0].KEY_BRIDGE_IP === "192.168.1.200",
+                  JSON.stringify(hueLink.sent));
+            check("no backoff stored after success",
+                  !storage.hasOwnProperty("CACHE_RELOCATE_FAILED"),
+                  JSON.stringify(storage));
+            next();
+        });
+    },
+    function fullSweepFitsDeadline(next) {
+        // Farthest address from the old one, found on the last probe round
+        relocate({ "192.168.1.254": OUR_BRIDGE }, cachedStorage("192.168.1.1"),
+                 "192.168.1.1", function(moved, elapsed, hueLink) {
+            check("whole /24 swept before the deadline", moved,
+                  hueLink.OPTIONS.HUE_BRIDGE_IP + " in " + elapsed + " ms");
+            next();
+        });
+    },
+    function otherBridgeIgnored(next) {
+        relocate({ "192.168.1.11": OTHER_BRIDGE, "192.168.1.150": OUR_BRIDGE },
+                 cachedStorage("192.168.1.10"), "192.168.1.10",
+                 function(moved, elapsed, hueLink) {
+            check("bridge with other ID ignored",
+                  moved && (hueLink.OPTIONS.HUE_BRIDGE_IP === "192.168.1.150"),
+                  hueLink.OPTIONS.HUE_BRIDGE_IP);
+            next();
+        });
+    },
+    function awayFromHomeBacksOff(next) {
+        var storage = cachedStorage("192.168.1.10");
+        relocate({}, storage, "192.168.1.10", function(moved, elapsed) {
+            check("no bridge gives up at the deadline",
+                  !moved && (elapsed < 4200), elapsed + " ms");
+            // Next app launch is a new JS runtime with the same localStorage
+            relocate({}, storage, "192.168.1.10",
+                     function(movedAgain, elapsedAgain, hueLink) {
+                check("next launch skips the sweep",
+                      !movedAgain && (hueLink.probes.length === 0),
+                      hueLink.probes.length + " probes");
+                next();
+            });
+        });
+    }
+];
+
+(function run(index) {
+    if (index === tests.length) {
+        console.log(failures ? (failures + " check(s) failed") : "All passed");
+        process.exit(failures ? 1 : 0);
+    }
+    tests[index](function() { run(index + 1); });
+})(0);